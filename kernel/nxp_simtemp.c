@@ -33,6 +33,16 @@
 #include <linux/timekeeping.h>
 #include <linux/delay.h> 
 #include <linux/rtc.h> 
+#include <linux/math64.h>
+#include <linux/thermal.h>
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+#include <linux/interrupt.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#endif
 #include "nxp_simtemp.h"
 
 /****************************************************************************
@@ -41,6 +51,9 @@
 #define SIMTEMP_DEV     "simtemp"
 #define SIMTEMP_CLASS   "simtemp_class"
 #define TIMEOUT 	    100
+#define TREND_WINDOW    16
+#define CAL_GAIN_ONE    65536
+#define CAL_LUT_MAX     16
 
 /****************************************************************************
  * Globals
@@ -51,6 +64,12 @@ static struct class *simtemp_class;
 static struct device *simtemp_sysdev;
 static struct task_struct *simtemp_thread1;
 static struct task_struct *simtemp_thread2;
+static struct thermal_zone_device *simtemp_tz;
+static DEFINE_MUTEX(simtemp_tz_mutex);
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+static struct iio_dev *simtemp_iio;
+static struct iio_trigger *simtemp_iio_trig;
+#endif
 static int sysfs_sampling_ms;
 static int sysfs_htemp_mC;
 static int sysfs_ltemp_mC;
@@ -60,9 +79,25 @@ static unsigned short state = 0;
 static int sampling_ms=1000;
 static int ltemp_alert=5000;
 static int htemp_alert=50000;
+static int trend_horizon_ms=5000;
+static int cal_offset_mC=0;
+static int cal_gain=CAL_GAIN_ONE;
+static int cal_lut_raw[CAL_LUT_MAX];
+static int cal_lut_mC[CAL_LUT_MAX];
+static int cal_lut_len=0;
+static char cooling_device[THERMAL_NAME_LENGTH]="cpufreq-cpu0";
+#ifndef SIM
+static bool word_read = false;
+static u8 temp_reg = 0;
+#endif
 static bool timeout_flag = false;
 static bool alert_flag = false;
 static bool alert_on = false;
+static bool trend_alert = false;
+static bool acq_dev = false;
+static bool acq_iio = false;
+static int last_temp_mC;
+static u64 sample_seq;
 struct mutex simtemp_mutex;
 #ifdef SIM
 static struct timer_list simtemp_timer;
@@ -82,11 +117,24 @@ struct stats{
 
 struct stats *stats_storage;
 
+/*Sliding window of recent samples for the slope estimate*/
+struct trend{
+	int temp_mC[TREND_WINDOW];
+	uint64_t timestamp_ns[TREND_WINDOW];
+	unsigned int head;
+	unsigned int count;
+	s64 sum_y;
+	s64 sum_xy;
+};
+
+static struct trend trend_storage;
+
 /****************************************************************************
  * Waitqueues declaration
  ****************************************************************************/
 DECLARE_WAIT_QUEUE_HEAD(simtemp_wq_poll);
 DECLARE_WAIT_QUEUE_HEAD(simtemp_wq_tout);
+DECLARE_WAIT_QUEUE_HEAD(simtemp_wq_acq);
 
 /****************************************************************************
  * Prototypes
@@ -97,6 +145,7 @@ static int f_ops_open(struct inode *inode, struct file *file);
 static int f_ops_release(struct inode *inode, struct file *file);
 static ssize_t f_ops_read(struct file *filp, char *buf, size_t len, loff_t *offset);
 static ssize_t f_ops_write(struct file *filp, const char *buf, size_t len, loff_t *offset);
+static long f_ops_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 static ssize_t sysfs_sampling_show(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t sysfs_sampling_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 static ssize_t sysfs_htemp_show(struct device *dev, struct device_attribute *attr, char *buf);
@@ -106,14 +155,44 @@ static ssize_t sysfs_ltemp_store(struct device *dev, struct device_attribute *at
 static ssize_t sysfs_mode_show(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t sysfs_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 static ssize_t sysfs_stats_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t sysfs_horizon_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t sysfs_horizon_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t sysfs_cal_offset_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t sysfs_cal_offset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t sysfs_cal_gain_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t sysfs_cal_gain_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t sysfs_snapshot_read(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count);
 int thread_function_states(void *pv);
 int thread_function_temp_meas(void *pv);
 static unsigned int simtemp_poll(struct file *filp, struct poll_table_struct *wait);
-static void measure_and_compare(simtemp_sample *ps);
+static void measure(simtemp_sample_v2 *ps);
+static void measure_and_compare(simtemp_sample_v2 *ps);
+static void sample_to_v1(const simtemp_sample_v2 *ps2, simtemp_sample *ps1);
+static int calibrate(int raw_mC);
+static bool trend_predict(int temp_mC, uint64_t timestamp_ns);
+static int simtemp_tz_get_temp(struct thermal_zone_device *tz, int *temp);
+static bool simtemp_tz_should_bind(struct thermal_zone_device *tz, const struct thermal_trip *trip,
+                                   struct thermal_cooling_device *cdev, struct cooling_spec *c);
+static void simtemp_thermal_register(void);
+static void simtemp_thermal_unregister(void);
+static void simtemp_thermal_create(void);
+static void simtemp_thermal_destroy(void);
+static void simtemp_thermal_sync(void);
+static int simtemp_thermal_set_trip(struct thermal_trip *trip, void *data);
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+static int simtemp_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, int *val, int *val2, long mask);
+static irqreturn_t simtemp_iio_trigger_handler(int irq, void *p);
+static int simtemp_iio_postenable(struct iio_dev *indio_dev);
+static int simtemp_iio_predisable(struct iio_dev *indio_dev);
+#endif
+static void simtemp_iio_register(struct device *parent);
+static void simtemp_iio_unregister(void);
+static void simtemp_iio_push(void);
 #ifdef SIM
 void timer_callback(struct timer_list *data);
 #else
 static int simtemp_probe(struct i2c_client *client);
+static void simtemp_read_lut(struct device *dev);
 static void simtemp_remove(struct i2c_client *client); 
 #endif
 
@@ -125,7 +204,8 @@ static struct file_operations f_ops={
 	.write   = f_ops_write,
 	.open    = f_ops_open,
 	.release = f_ops_release,
-	.poll    = simtemp_poll
+	.poll    = simtemp_poll,
+	.unlocked_ioctl = f_ops_ioctl
 };
 
 /****************************************************************************
@@ -159,6 +239,43 @@ static struct i2c_driver simtemp_driver = {
 };
 #endif
 
+/****************************************************************************
+ * Thermal zone operations
+ ****************************************************************************/
+static const struct thermal_zone_device_ops simtemp_tz_ops = {
+	.get_temp = simtemp_tz_get_temp,
+	.should_bind = simtemp_tz_should_bind,
+};
+
+/****************************************************************************
+ * IIO channels and operations
+ ****************************************************************************/
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+static const struct iio_chan_spec simtemp_iio_channels[] = {
+	{
+		.type = IIO_TEMP,
+		.info_mask_separate = BIT(IIO_CHAN_INFO_PROCESSED),
+		.scan_index = 0,
+		.scan_type = {
+			.sign = 's',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(1),
+};
+
+static const struct iio_info simtemp_iio_info = {
+	.read_raw = simtemp_iio_read_raw,
+};
+
+static const struct iio_buffer_setup_ops simtemp_iio_buffer_ops = {
+	.postenable = simtemp_iio_postenable,
+	.predisable = simtemp_iio_predisable,
+};
+#endif
+
 /****************************************************************************
  * Attributes for sysfs class in simtemp
  ***************************************************************************/
@@ -167,6 +284,9 @@ static struct i2c_driver simtemp_driver = {
  DEVICE_ATTR(sysfs_ltemp_mC, 0660, sysfs_ltemp_show, sysfs_ltemp_store);
  DEVICE_ATTR(sysfs_mode, 0660, sysfs_mode_show, sysfs_mode_store);
  DEVICE_ATTR(sysfs_stats, 0660, sysfs_stats_show, NULL);
+ DEVICE_ATTR(sysfs_horizon_ms, 0660, sysfs_horizon_show, sysfs_horizon_store);
+ DEVICE_ATTR(sysfs_cal_offset_mC, 0660, sysfs_cal_offset_show, sysfs_cal_offset_store);
+ DEVICE_ATTR(sysfs_cal_gain, 0660, sysfs_cal_gain_show, sysfs_cal_gain_store);
  
  static struct attribute *simtemp_attrs[] = {
         &dev_attr_sysfs_sampling_ms.attr,
@@ -174,11 +294,23 @@ static struct i2c_driver simtemp_driver = {
         &dev_attr_sysfs_ltemp_mC.attr,
         &dev_attr_sysfs_mode.attr,
         &dev_attr_sysfs_stats.attr,
+        &dev_attr_sysfs_horizon_ms.attr,
+        &dev_attr_sysfs_cal_offset_mC.attr,
+        &dev_attr_sysfs_cal_gain.attr,
         NULL, 
 };
 
+/*Binary attribute with the whole device state, see simtemp_snapshot*/
+ BIN_ATTR(sysfs_snapshot, 0440, sysfs_snapshot_read, NULL, sizeof(simtemp_snapshot));
+
+static struct bin_attribute *simtemp_bin_attrs[] = {
+        &bin_attr_sysfs_snapshot,
+        NULL,
+};
+
 static const struct attribute_group simtemp_group = {
         .attrs = simtemp_attrs,
+        .bin_attrs = simtemp_bin_attrs,
 };
 
 static const struct attribute_group *simtemp_groups[] = {
@@ -252,6 +384,55 @@ static ssize_t sysfs_stats_show(struct device *dev, struct device_attribute *att
 	return strlen(sysfs_stats);
 }
 
+static ssize_t sysfs_horizon_show(struct device *dev, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%d\n", trend_horizon_ms);
+}
+
+static ssize_t sysfs_cal_offset_show(struct device *dev, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%d\n", cal_offset_mC);
+}
+
+static ssize_t sysfs_cal_gain_show(struct device *dev, struct device_attribute *attr, char *buf){
+	return sprintf(buf, "%d\n", cal_gain);
+}
+
+/*Consistent binary copy of configuration and stats in a single read*/
+static ssize_t sysfs_snapshot_read(struct file *filp, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t off, size_t count){
+	simtemp_snapshot snap;
+	
+	if(off >= sizeof(snap))
+		return 0;
+	if(count > sizeof(snap) - off)
+		count = sizeof(snap) - off;
+	
+	memset(&snap, 0, sizeof(snap));
+	snap.version = SIMTEMP_SNAPSHOT_VERSION;
+	snap.size = sizeof(snap);
+	
+	mutex_lock(&simtemp_mutex);
+	snap.sampling_ms = sampling_ms;
+	snap.htemp_mC = htemp_alert;
+	snap.ltemp_mC = ltemp_alert;
+	snap.horizon_ms = trend_horizon_ms;
+	snap.last_temp_mC = last_temp_mC;
+	snap.last_error_ns = stats_storage->last_error_ns;
+	if(stats_storage->LOW_TEMP_ALERT)
+		snap.last_error_type = SIMTEMP_ERROR_LOW_TEMP;
+	else if(stats_storage->HIGH_TEMP_ALERT)
+		snap.last_error_type = SIMTEMP_ERROR_HIGH_TEMP;
+	memcpy(snap.mode, sysfs_mode, sizeof(snap.mode));
+	snap.cal_offset_mC = cal_offset_mC;
+	snap.cal_gain = cal_gain;
+	snap.cal_lut_len = cal_lut_len;
+#ifndef SIM
+	snap.word_read = word_read;
+#endif
+	mutex_unlock(&simtemp_mutex);
+	
+	memcpy(buf, (char *)&snap + off, count);
+	return count;
+}
+
 /****************************************************************************
  * sysfs store functions
  ***************************************************************************/
@@ -260,8 +441,10 @@ static ssize_t sysfs_sampling_store(struct device *dev, struct device_attribute
 {
 	int uspace_sample;
 	if(kstrtoint(buf, 10, &uspace_sample) == 0){
+		mutex_lock(&simtemp_mutex);
 		sysfs_sampling_ms = uspace_sample;
 		sampling_ms = sysfs_sampling_ms;
+		mutex_unlock(&simtemp_mutex);
 	}
 	state = 1;   
 	wake_up(&simtemp_wq_tout);
@@ -273,8 +456,11 @@ static ssize_t sysfs_htemp_store(struct device *dev, struct device_attribute *at
 {
 	int uspace_htemp;
 	if(kstrtoint(buf, 10, &uspace_htemp) == 0){
+		mutex_lock(&simtemp_mutex);
 		sysfs_htemp_mC = uspace_htemp;
 		htemp_alert = sysfs_htemp_mC;
+		mutex_unlock(&simtemp_mutex);
+		simtemp_thermal_sync();
 	}
 	state = 1;   
 	wake_up(&simtemp_wq_tout);
@@ -286,8 +472,10 @@ static ssize_t sysfs_ltemp_store(struct device *dev, struct device_attribute *at
 {
 	int uspace_ltemp;
 	if(kstrtoint(buf, 10, &uspace_ltemp) == 0){
+		mutex_lock(&simtemp_mutex);
 		sysfs_ltemp_mC = uspace_ltemp;
 		ltemp_alert = sysfs_ltemp_mC;
+		mutex_unlock(&simtemp_mutex);
 	}
 	state = 1;   
 	wake_up(&simtemp_wq_tout);
@@ -297,11 +485,50 @@ static ssize_t sysfs_ltemp_store(struct device *dev, struct device_attribute *at
 
 static ssize_t sysfs_mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {	
+	mutex_lock(&simtemp_mutex);
 	strncpy(sysfs_mode, buf, sizeof(sysfs_mode));
+	mutex_unlock(&simtemp_mutex);
+	
+	return count;
+}
+
+/*A horizon of 0 disables the predictive alert*/
+static ssize_t sysfs_horizon_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	int uspace_horizon;
+	if(kstrtoint(buf, 10, &uspace_horizon) == 0 && uspace_horizon >= 0){
+		mutex_lock(&simtemp_mutex);
+		trend_horizon_ms = uspace_horizon;
+		mutex_unlock(&simtemp_mutex);
+	}
+	
+	return count;
+}
+
+static ssize_t sysfs_cal_offset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	int uspace_offset;
+	if(kstrtoint(buf, 10, &uspace_offset) == 0){
+		mutex_lock(&simtemp_mutex);
+		cal_offset_mC = uspace_offset;
+		mutex_unlock(&simtemp_mutex);
+	}
 	
 	return count;
 }
 
+/*Gain in Q16.16, 65536 is 1.0*/
+static ssize_t sysfs_cal_gain_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	int uspace_gain;
+	if(kstrtoint(buf, 10, &uspace_gain) == 0 && uspace_gain > 0){
+		mutex_lock(&simtemp_mutex);
+		cal_gain = uspace_gain;
+		mutex_unlock(&simtemp_mutex);
+	}
+	
+	return count;
+}
 
 /****************************************************************************
  * thread functions
@@ -313,9 +540,13 @@ int thread_function_states(void *pv)
 			wait_event_timeout(simtemp_wq_tout, state != 0, msecs_to_jiffies(sampling_ms));
 			{
 				if(state==0){
-					wake_up(&simtemp_wq_poll);
+					/*Every event is numbered when it is raised, see simtemp_sample_v2.seq*/
+					mutex_lock(&simtemp_mutex);
+					sample_seq++;
 					timeout_flag = true; 
+					mutex_unlock(&simtemp_mutex);
 					alert_on = false;
+					wake_up(&simtemp_wq_poll);
 				}
 			}
 			if(state == 2){
@@ -328,10 +559,14 @@ int thread_function_states(void *pv)
 
 
 int thread_function_temp_meas(void *pv){
-	simtemp_sample simtemp_st; 
+	simtemp_sample_v2 simtemp_st; 
 
 	
 	while(!kthread_should_stop()){
+			/*Idle until a /dev/simtemp client or an enabled IIO buffer needs samples*/
+			wait_event_interruptible(simtemp_wq_acq, READ_ONCE(acq_dev) || READ_ONCE(acq_iio) || kthread_should_stop());
+			if(kthread_should_stop())
+				break;
 #ifndef SIM		
 			msleep(150);
 #else			
@@ -341,15 +576,35 @@ int thread_function_temp_meas(void *pv){
 			mutex_lock(&simtemp_mutex);	
 			 			 
 			measure_and_compare(&simtemp_st);
+			
+			/*Only these periodic samples feed the slope estimate*/
+			trend_alert = trend_predict(simtemp_st.temp_mC, simtemp_st.mono_ns);
+			if(trend_alert)
+				simtemp_st.flags |= SIMTEMP_FLAG_PREDICT_ALERT;
+			else
+				simtemp_st.flags &= ~SIMTEMP_FLAG_PREDICT_ALERT;
 			 			 	
 			mutex_unlock(&simtemp_mutex);
+			
+			/*Push the sample to the IIO buffer*/
+			simtemp_iio_push();
 	
-			/*Activate alert for low or high temperature*/
-			if((simtemp_st.LOW_TEMP_ALERT == 1 || simtemp_st.HIGH_TEMP_ALERT == 1) && alert_on == false)
+			/*Activate alert for low or high temperature, reached or predicted*/
+			if((simtemp_st.flags & (SIMTEMP_FLAG_LOW_TEMP_ALERT | SIMTEMP_FLAG_HIGH_TEMP_ALERT |
+			    SIMTEMP_FLAG_PREDICT_ALERT)) && alert_on == false)
 			 {
                 alert_on = true;			 
+				mutex_lock(&simtemp_mutex);
+				sample_seq++;
 				alert_flag = true;
+				mutex_unlock(&simtemp_mutex);
 				wake_up(&simtemp_wq_poll);	 						
+				
+				/*Let the thermal governors act without waiting for the next poll*/
+				mutex_lock(&simtemp_tz_mutex);
+				if(simtemp_tz)
+					thermal_zone_device_update(simtemp_tz, THERMAL_EVENT_UNSPECIFIED);
+				mutex_unlock(&simtemp_tz_mutex);
 			 }
 			
 	}
@@ -359,67 +614,466 @@ int thread_function_temp_meas(void *pv){
 /****************************************************************************
  * Poll function
  ****************************************************************************/
+/*Flags are consumed by read, poll only reports that a sample is pending*/
 static unsigned int simtemp_poll(struct file *filp, struct poll_table_struct *wait)
 {
 	poll_wait(filp, &simtemp_wq_poll, wait);
 		
-	if(timeout_flag){
-		timeout_flag = false;
+	if(timeout_flag || alert_flag)
 		return POLLIN | POLLRDNORM;	
+	
+    return 0; 
+}
+
+
+/****************************************************************************
+ * Slope estimate and time-to-threshold prediction
+ ****************************************************************************/
+/*
+ * Least-squares slope over the last TREND_WINDOW samples, with x being the
+ * position of the sample in the window (0 is the oldest). Only the
+ * measurement thread calls it, so the samples are evenly spaced and the
+ * position is proportional to time (reads, thermal and IIO requests come
+ * at any time and do not feed the window). The sums are updated
+ * incrementally when the window slides, so every sample costs O(1):
+ *   sum_xy' = sum_xy - (sum_y - oldest) + (N-1)*newest
+ *   sum_y'  = sum_y - oldest + newest
+ * Returns true when the projected time to reach ltemp_alert or htemp_alert
+ * is within trend_horizon_ms. Limits already crossed are left to the
+ * regular alerts.
+ */
+static bool trend_predict(int temp_mC, uint64_t timestamp_ns){
+	struct trend *tr = &trend_storage;
+	const s64 n = TREND_WINDOW;
+	const s64 sum_x = n*(n-1)/2;
+	const s64 den = n*n*(n*n-1)/12;		/*n*sum_xx - sum_x^2*/
+	s64 num, dist;
+	u64 span_ms;
+	unsigned int newest;
+	int oldest;
+
+	if(tr->count < TREND_WINDOW){
+		tr->sum_y += temp_mC;
+		tr->sum_xy += (s64)tr->count*temp_mC;
+		tr->temp_mC[tr->count] = temp_mC;
+		tr->timestamp_ns[tr->count] = timestamp_ns;
+		tr->count++;
+		if(tr->count < TREND_WINDOW)
+			return false;
 	}
+	else{
+		oldest = tr->temp_mC[tr->head];
+		tr->sum_xy += (n-1)*temp_mC - (tr->sum_y - oldest);
+		tr->sum_y += temp_mC - oldest;
+		tr->temp_mC[tr->head] = temp_mC;
+		tr->timestamp_ns[tr->head] = timestamp_ns;
+		tr->head = (tr->head + 1) % TREND_WINDOW;
+	}
+
+	if(trend_horizon_ms == 0)
+		return false;
+
+	/*Slope in mC per sample is num/den*/
+	num = n*tr->sum_xy - sum_x*tr->sum_y;
+	if(num > 0)
+		dist = (s64)htemp_alert - temp_mC;
+	else if(num < 0)
+		dist = (s64)ltemp_alert - temp_mC;
+	else
+		return false;
+
+	if(dist == 0 || (dist > 0) != (num > 0))
+		return false;
+
+	newest = (tr->head + TREND_WINDOW - 1) % TREND_WINDOW;
+	span_ms = div_u64(tr->timestamp_ns[newest] - tr->timestamp_ns[tr->head], NSEC_PER_MSEC);
+
+	/*
+	 * time_to_threshold = dist/slope * span/(n-1) <= horizon, rearranged
+	 * to avoid divisions in the acquisition path.
+	 */
+	return abs(dist)*den*(s64)span_ms <= (s64)trend_horizon_ms*abs(num)*(n-1);
+}
+
+/****************************************************************************
+ * Thermal zone
+ ****************************************************************************/
+/*
+ * Reads the sensor, so the zone is valid even if acquisition is not running.
+ * Limits and stats are left to the /dev/simtemp path.
+ */
+static int simtemp_tz_get_temp(struct thermal_zone_device *tz, int *temp){
+	simtemp_sample_v2 simtemp_st;
 	
-	if(alert_flag){
-		alert_flag = false;
-		return POLLIN | POLLRDNORM;	
+	mutex_lock(&simtemp_mutex);
+	measure(&simtemp_st);
+	mutex_unlock(&simtemp_mutex);
+	
+	*temp = simtemp_st.temp_mC;
+	return 0;
+}
+
+/*
+ * Called by the thermal core for every cooling device, when the zone is
+ * registered and when new cooling devices appear. The passive trip is bound
+ * to the cooling device with the type in cooling_device (cpufreq-cpu0 by
+ * default, property cooling_device in Device Tree), with the default
+ * limits and weight, so the governor throttles it above htemp_alert.
+ */
+static bool simtemp_tz_should_bind(struct thermal_zone_device *tz, const struct thermal_trip *trip,
+                                   struct thermal_cooling_device *cdev, struct cooling_spec *c){
+	return trip->type == THERMAL_TRIP_PASSIVE && !strcmp(cdev->type, cooling_device);
+}
+
+/*
+ * Single passive trip at htemp_alert. ltemp_alert is not mapped, any trip
+ * at the low limit would engage cooling above it. The zone is polled every
+ * sampling_ms and it is also updated as soon as an alert is raised.
+ * Failing to register is not fatal, /dev/simtemp keeps working.
+ * Called with simtemp_tz_mutex held.
+ */
+static void simtemp_thermal_create(void){
+	struct thermal_trip trips[] = {
+		{ .temperature = htemp_alert, .type = THERMAL_TRIP_PASSIVE },
+	};
+	
+	/*CONFIG_THERMAL is built-in when enabled, nothing to load*/
+	if(!IS_ENABLED(CONFIG_THERMAL))
+		return;
+
+	simtemp_tz = thermal_zone_device_register_with_trips(SIMTEMP_DEV, trips, ARRAY_SIZE(trips),
+	                                                     NULL, &simtemp_tz_ops, NULL, 0, sampling_ms);
+	if(IS_ERR(simtemp_tz)){
+		printk(KERN_WARNING "It is not possible to register the thermal zone\n");
+		simtemp_tz = NULL;
+		return;
 	}
 	
-    return 0; 
+	if(thermal_zone_device_enable(simtemp_tz)){
+		printk(KERN_WARNING "It is not possible to enable the thermal zone\n");
+		simtemp_thermal_destroy();
+	}
+}
+
+/*Called with simtemp_tz_mutex held*/
+static void simtemp_thermal_destroy(void){
+	if(simtemp_tz){
+		thermal_zone_device_unregister(simtemp_tz);
+		simtemp_tz = NULL;
+	}
+}
+
+static void simtemp_thermal_register(void){
+	mutex_lock(&simtemp_tz_mutex);
+	simtemp_thermal_create();
+	mutex_unlock(&simtemp_tz_mutex);
+}
+
+static void simtemp_thermal_unregister(void){
+	mutex_lock(&simtemp_tz_mutex);
+	simtemp_thermal_destroy();
+	mutex_unlock(&simtemp_tz_mutex);
+}
+
+/*Runs under the zone lock, for each trip of the zone*/
+static int simtemp_thermal_set_trip(struct thermal_trip *trip, void *data){
+	if(trip->type == THERMAL_TRIP_PASSIVE)
+		thermal_zone_set_trip_temp(simtemp_tz, trip, *(int *)data);
+	return 0;
 }
 
+/*
+ * The thermal core keeps its own copy of the trips, so the passive trip is
+ * moved in place when htemp_alert changes. The zone keeps its sysfs path
+ * and its cooling device bindings. Nothing is done if the zone does not
+ * exist (sensor not probed yet or registration failed).
+ */
+static void simtemp_thermal_sync(void){
+	int temp = READ_ONCE(htemp_alert);
+	
+	mutex_lock(&simtemp_tz_mutex);
+	if(simtemp_tz){
+		thermal_zone_for_each_trip(simtemp_tz, simtemp_thermal_set_trip, &temp);
+		thermal_zone_device_update(simtemp_tz, THERMAL_TRIP_CHANGED);
+	}
+	mutex_unlock(&simtemp_tz_mutex);
+}
+
+/****************************************************************************
+ * IIO device
+ ****************************************************************************/
+/*
+ * Only built when the kernel has IIO triggered buffers. With CONFIG_IIO=m
+ * the industrialio, kfifo_buf and industrialio-triggered-buffer modules
+ * must be loaded first (simtemp load does it, see Ops::load_dependencies).
+ */
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+/*IIO temperature unit is millidegrees Celsius, same as temp_mC*/
+static int simtemp_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, int *val, int *val2, long mask){
+	simtemp_sample_v2 simtemp_st;
+	int ret;
+	
+	if(mask != IIO_CHAN_INFO_PROCESSED)
+		return -EINVAL;
+	
+	/*Not available while the buffer is enabled (-EBUSY)*/
+	ret = iio_device_claim_direct_mode(indio_dev);
+	if(ret)
+		return ret;
+	
+	/*Direct reads only measure, without touching limits, stats or the trend window*/
+	mutex_lock(&simtemp_mutex);
+	measure(&simtemp_st);
+	mutex_unlock(&simtemp_mutex);
+	
+	iio_device_release_direct_mode(indio_dev);
+	
+	*val = simtemp_st.temp_mC;
+	return IIO_VAL_INT;
+}
+
+/*Runs in the context of the measurement thread through iio_trigger_poll_nested*/
+static irqreturn_t simtemp_iio_trigger_handler(int irq, void *p){
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct {
+		s32 temp_mC;
+		s64 timestamp __aligned(8);
+	} scan = { };
+	
+	scan.temp_mC = READ_ONCE(last_temp_mC);
+	iio_push_to_buffers_with_timestamp(indio_dev, &scan, iio_get_time_ns(indio_dev));
+	iio_trigger_notify_done(indio_dev->trig);
+	
+	return IRQ_HANDLED;
+}
+
+/*
+ * Enabling the buffer starts measuring, without any /dev/simtemp client.
+ * Only the wait queue is used, the thread may already be stopped on exit.
+ */
+static int simtemp_iio_postenable(struct iio_dev *indio_dev){
+	WRITE_ONCE(acq_iio, true);
+	wake_up(&simtemp_wq_acq);
+	return 0;
+}
+
+/*The thread goes idle unless a /dev/simtemp client started it*/
+static int simtemp_iio_predisable(struct iio_dev *indio_dev){
+	WRITE_ONCE(acq_iio, false);
+	return 0;
+}
+
+/*
+ * IIO device with a temperature and a timestamp channel. Its own trigger
+ * is fired by the measurement thread after every sample, and the
+ * triggered buffer pushes the scans into the IIO kfifo (watermark and
+ * length are set through the standard buffer attributes). Enabling the
+ * buffer starts the thread, and the scans follow its fixed rate (10 ms
+ * simulated, 150 ms I2C).
+ * Failing to register is not fatal, /dev/simtemp keeps working.
+ */
+static void simtemp_iio_register(struct device *parent){
+	struct iio_dev *indio_dev;
+	
+	indio_dev = iio_device_alloc(parent, 0);
+	if(!indio_dev){
+		printk(KERN_WARNING "It is not possible to allocate the IIO device\n");
+		return;
+	}
+	indio_dev->name = SIMTEMP_DEV;
+	indio_dev->info = &simtemp_iio_info;
+	indio_dev->channels = simtemp_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(simtemp_iio_channels);
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	
+	simtemp_iio_trig = iio_trigger_alloc(parent, "%s-dev%d", indio_dev->name, iio_device_id(indio_dev));
+	if(!simtemp_iio_trig){
+		printk(KERN_WARNING "It is not possible to allocate the IIO trigger\n");
+		goto free_device;
+	}
+	
+	if(iio_trigger_register(simtemp_iio_trig)){
+		printk(KERN_WARNING "It is not possible to register the IIO trigger\n");
+		goto free_trigger;
+	}
+	indio_dev->trig = iio_trigger_get(simtemp_iio_trig);
+	
+	if(iio_triggered_buffer_setup(indio_dev, NULL, simtemp_iio_trigger_handler, &simtemp_iio_buffer_ops)){
+		printk(KERN_WARNING "It is not possible to set up the IIO buffer\n");
+		goto rem_trigger;
+	}
+	
+	if(iio_device_register(indio_dev)){
+		printk(KERN_WARNING "It is not possible to register the IIO device\n");
+		goto rem_buffer;
+	}
+	
+	simtemp_iio = indio_dev;
+	return;
+	
+rem_buffer:
+	iio_triggered_buffer_cleanup(indio_dev);
+	
+rem_trigger:
+	iio_trigger_unregister(simtemp_iio_trig);
+	
+free_trigger:
+	iio_device_free(indio_dev);
+	iio_trigger_free(simtemp_iio_trig);
+	simtemp_iio_trig = NULL;
+	return;
+	
+free_device:
+	iio_device_free(indio_dev);
+}
+
+static void simtemp_iio_unregister(void){
+	if(!simtemp_iio)
+		return;
+	
+	iio_device_unregister(simtemp_iio);
+	iio_triggered_buffer_cleanup(simtemp_iio);
+	iio_trigger_unregister(simtemp_iio_trig);
+	/*Releases the reference taken for indio_dev->trig*/
+	iio_device_free(simtemp_iio);
+	iio_trigger_free(simtemp_iio_trig);
+	simtemp_iio = NULL;
+	simtemp_iio_trig = NULL;
+}
+
+static void simtemp_iio_push(void){
+	if(simtemp_iio)
+		iio_trigger_poll_nested(simtemp_iio_trig);
+}
+#else
+static void simtemp_iio_register(struct device *parent){
+}
+
+static void simtemp_iio_unregister(void){
+}
+
+static void simtemp_iio_push(void){
+}
+#endif
+
+/****************************************************************************
+ * Calibration
+ ****************************************************************************/
+/*
+ * Converts a raw reading (already in millidegrees) with integer math:
+ * piecewise linear lookup table (from Device Tree, at least 2 points, the
+ * end segments are extrapolated), then gain in Q16.16 and offset.
+ * Called with simtemp_mutex held.
+ */
+static int calibrate(int raw_mC){
+	s64 temp = raw_mC;
+	int i;
+	
+	if(cal_lut_len >= 2){
+		for(i = 1; i < cal_lut_len - 1 && raw_mC > cal_lut_raw[i]; i++)
+			;
+		temp = cal_lut_mC[i-1] + div_s64((s64)(raw_mC - cal_lut_raw[i-1]) * (cal_lut_mC[i] - cal_lut_mC[i-1]),
+		                                 cal_lut_raw[i] - cal_lut_raw[i-1]);
+	}
+	
+	temp = (temp * cal_gain + CAL_GAIN_ONE/2) >> 16;
+	
+	return (int)(temp + cal_offset_mC);
+}
 
 /****************************************************************************
  * read temperature from device and compare limits
  ****************************************************************************/
-static void measure_and_compare(simtemp_sample *simtemp_s){
+/*Only reads the sensor, called with simtemp_mutex held*/
+static void measure(simtemp_sample_v2 *simtemp_s){
 #ifndef SIM
 	int temp;
 #endif
 	int temp_mC;
 	ktime_t current_time;
+	u64 start_ns;
+	
+	memset(simtemp_s, 0, sizeof(*simtemp_s));
+	simtemp_s->version = SIMTEMP_ABI_V2;
+	simtemp_s->size = sizeof(*simtemp_s);
+	simtemp_s->sampling_ms = sampling_ms;
 	
 	/*Gets current time*/
 	current_time = ktime_get_real_ns();
 	simtemp_s->timestamp_ns = current_time;
+	start_ns = ktime_get_ns();
+	simtemp_s->mono_ns = start_ns;
 
 #ifndef SIM	
 	/*Get the temperature from the sensor*/
-	temp = i2c_smbus_read_byte(simtemp_client);
-	temp_mC = temp*1000;
+	if(word_read)
+		temp = i2c_smbus_read_word_swapped(simtemp_client, temp_reg);
+	else
+		temp = i2c_smbus_read_byte(simtemp_client);
+	simtemp_s->acq_ns = ktime_get_ns() - start_ns;
+	
+	if(temp < 0){
+		/*Bus error, keep the previous value*/
+		temp_mC = last_temp_mC;
+	}
+	else if(word_read){
+		/*Two's complement, left justified, 8 fraction bits (LM75/TMP102 style)*/
+		temp_mC = calibrate(((s16)temp * 1000) / 256);
+	}
+	else{
+		/*Two's complement, whole degrees (TC74 style)*/
+		temp_mC = calibrate((s8)temp * 1000);
+	}
 #else
 	/*Get simulated temperature from timer*/	
-	temp_mC = sim_temp;
+	temp_mC = calibrate(sim_temp);
+	simtemp_s->acq_ns = ktime_get_ns() - start_ns;
 #endif	
 	
 	simtemp_s->temp_mC = temp_mC;
+	last_temp_mC = temp_mC;
+}
+
+/*Reads the sensor and records the alerts, called with simtemp_mutex held*/
+static void measure_and_compare(simtemp_sample_v2 *simtemp_s){
+	int temp_mC;
+	u64 current_time;
+	
+	measure(simtemp_s);
+	temp_mC = simtemp_s->temp_mC;
+	current_time = simtemp_s->timestamp_ns;
 	
 	/*Compare limits*/
 	if(temp_mC <=ltemp_alert){
-		simtemp_s->LOW_TEMP_ALERT = 1;		
+		simtemp_s->flags |= SIMTEMP_FLAG_LOW_TEMP_ALERT;		
 		stats_storage->last_error_ns=current_time;
 		stats_storage->LOW_TEMP_ALERT = 1;
 		stats_storage->HIGH_TEMP_ALERT = 0;
 	}
-	else
-		simtemp_s->LOW_TEMP_ALERT = 0;
 					
 	if(temp_mC >=htemp_alert){
-		simtemp_s->HIGH_TEMP_ALERT = 1;		
+		simtemp_s->flags |= SIMTEMP_FLAG_HIGH_TEMP_ALERT;		
 		stats_storage->last_error_ns=current_time; 
 		stats_storage->LOW_TEMP_ALERT = 0;
 		stats_storage->HIGH_TEMP_ALERT = 1;
 	}
-	else
-		simtemp_s->HIGH_TEMP_ALERT = 0;
+
+	/*Latest prediction of the measurement thread, see trend_predict()*/
+	if(trend_alert)
+		simtemp_s->flags |= SIMTEMP_FLAG_PREDICT_ALERT;
+}
+
+/*Legacy layout for files that did not negotiate ABI v2*/
+static void sample_to_v1(const simtemp_sample_v2 *ps2, simtemp_sample *ps1){
+	memset(ps1, 0, sizeof(*ps1));
+	ps1->timestamp_ns = ps2->timestamp_ns;
+	ps1->temp_mC = ps2->temp_mC;
+	ps1->sampling_ms = ps2->sampling_ms;
+	ps1->NEW_SAMPLE = !!(ps2->flags & SIMTEMP_FLAG_NEW_SAMPLE);
+	ps1->LOW_TEMP_ALERT = !!(ps2->flags & SIMTEMP_FLAG_LOW_TEMP_ALERT);
+	ps1->HIGH_TEMP_ALERT = !!(ps2->flags & SIMTEMP_FLAG_HIGH_TEMP_ALERT);
+	ps1->PREDICT_ALERT = !!(ps2->flags & SIMTEMP_FLAG_PREDICT_ALERT);
 }
 
 /****************************************************************************
@@ -427,6 +1081,8 @@ static void measure_and_compare(simtemp_sample *simtemp_s){
  ****************************************************************************/
 static int f_ops_open(struct inode *inode, struct file *file)
 {
+	/*Every open file starts with the ABI v1 layout*/
+	file->private_data = (void *)(uintptr_t)SIMTEMP_ABI_V1;
 	return 0;
 }
 
@@ -441,20 +1097,85 @@ static int f_ops_release(struct inode *inode, struct file *file)
 /****************************************************************************
  * File operations - read function
  ****************************************************************************/
+/*
+ * Blocks until the next sample (sampling timeout) or alert is pending,
+ * unless the file was opened with O_NONBLOCK. Returns one whole sample in
+ * the layout negotiated for this file.
+ */
 static ssize_t f_ops_read(struct file *filp, char *buf, size_t len, loff_t *offset){
-	simtemp_sample simtemp_st; 
-		
-	mutex_lock(&simtemp_mutex);	
+	simtemp_sample_v2 simtemp_st; 
+	simtemp_sample simtemp_st_v1;
+	u32 abi = (uintptr_t)filp->private_data;
+	size_t size = (abi == SIMTEMP_ABI_V2) ? sizeof(simtemp_st) : sizeof(simtemp_st_v1);
+	bool new_sample;
+	
+	if(len < size)
+		return -EINVAL;
+	
+	/*The flags are consumed under the mutex, another reader may take them first*/
+	mutex_lock(&simtemp_mutex);
+	while(!timeout_flag && !alert_flag){
+		mutex_unlock(&simtemp_mutex);
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(simtemp_wq_poll, timeout_flag || alert_flag))
+			return -ERESTARTSYS;
+		mutex_lock(&simtemp_mutex);
+	}
+	new_sample = timeout_flag;
+	timeout_flag = false;
+	alert_flag = false;
 
 	measure_and_compare(&simtemp_st);
+	
+	/*Number of the last event consumed, earlier ones not delivered show as a gap*/
+	simtemp_st.seq = sample_seq;
 
 	mutex_unlock(&simtemp_mutex);	
+	
+	if(new_sample)
+		simtemp_st.flags |= SIMTEMP_FLAG_NEW_SAMPLE;
 
-	if(copy_to_user(buf, &simtemp_st, sizeof(simtemp_st))){
-		printk(KERN_ERR "Error copying struct to userspace\n");
+	if(abi == SIMTEMP_ABI_V2){
+		if(copy_to_user(buf, &simtemp_st, size)){
+			printk(KERN_ERR "Error copying struct to userspace\n");
+			return -EFAULT;
+		}
+	}
+	else{
+		sample_to_v1(&simtemp_st, &simtemp_st_v1);
+		if(copy_to_user(buf, &simtemp_st_v1, size)){
+			printk(KERN_ERR "Error copying struct to userspace\n");
+			return -EFAULT;
+		}
 	}
 			
-    return 0;
+    return size;
+}
+
+/****************************************************************************
+ * File operations - ioctl function
+ ****************************************************************************/
+static long f_ops_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	u32 abi;
+	
+	switch(cmd){
+	case SIMTEMP_IOC_SET_ABI:
+		if(copy_from_user(&abi, (u32 __user *)arg, sizeof(abi)))
+			return -EFAULT;
+		if(abi != SIMTEMP_ABI_V1 && abi != SIMTEMP_ABI_V2)
+			return -EINVAL;
+		filp->private_data = (void *)(uintptr_t)abi;
+		return 0;
+	case SIMTEMP_IOC_GET_ABI:
+		abi = (uintptr_t)filp->private_data;
+		if(copy_to_user((u32 __user *)arg, &abi, sizeof(abi)))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
 }
 
 /****************************************************************************
@@ -466,12 +1187,48 @@ static ssize_t f_ops_write(struct file *filp, const char *buf, size_t len, loff_
 	/*Setting timer for the first-time run*/
 	mod_timer(&simtemp_timer, jiffies + msecs_to_jiffies(TIMEOUT));
 #endif
+	WRITE_ONCE(acq_dev, true);
 	wake_up_process(simtemp_thread1);
-	wake_up_process(simtemp_thread2);
+	wake_up(&simtemp_wq_acq);
 	return 0;
 }
 
 
+/****************************************************************************
+ * Read calibration table from Device Tree
+ ****************************************************************************/
+#ifndef SIM
+/*cal_lut_mC = <raw0 mC0 raw1 mC1 ...>, raw values in increasing order*/
+static void simtemp_read_lut(struct device *dev)
+{
+	s32 lut[2*CAL_LUT_MAX];
+	int n, i;
+	
+	n = of_property_count_u32_elems(dev->of_node, "cal_lut_mC");
+	if(n <= 0)
+		return;
+	
+	if(n % 2 || n < 4 || n > 2*CAL_LUT_MAX ||
+	   of_property_read_u32_array(dev->of_node, "cal_lut_mC", (u32 *)lut, n)){
+		printk(KERN_WARNING "Invalid cal_lut_mC, calibration table ignored\n");
+		return;
+	}
+	
+	for(i = 2; i < n; i += 2){
+		if(lut[i] <= lut[i-2]){
+			printk(KERN_WARNING "cal_lut_mC is not in increasing order, calibration table ignored\n");
+			return;
+		}
+	}
+	
+	for(i = 0; i < n/2; i++){
+		cal_lut_raw[i] = lut[2*i];
+		cal_lut_mC[i] = lut[2*i+1];
+	}
+	cal_lut_len = n/2;
+}
+#endif
+
 /****************************************************************************
  * Probe function
  ****************************************************************************/
@@ -479,6 +1236,7 @@ static ssize_t f_ops_write(struct file *filp, const char *buf, size_t len, loff_
 static int simtemp_probe(struct i2c_client *client)
 {
 	struct device *dev = &client->dev;
+	const char *cdev_type;
 	int dt_value=0;
 	int ret_value=0;
 	
@@ -491,8 +1249,37 @@ static int simtemp_probe(struct i2c_client *client)
 		
 	ret_value = of_property_read_u32(dev->of_node, "sampling_ms", &dt_value);
 	sampling_ms = dt_value;
+	
+	/*Optional, keeps the default horizon when it is not present*/
+	if(of_property_read_u32(dev->of_node, "trend_horizon_ms", &dt_value) == 0)
+		trend_horizon_ms = dt_value;
+	
+	/*Optional calibration, see calibrate()*/
+	word_read = of_property_read_bool(dev->of_node, "word_read");
+	
+	/*Register of the word read, 0x00 is the temperature on LM75/TMP102*/
+	if(of_property_read_u32(dev->of_node, "temp_reg", &dt_value) == 0)
+		temp_reg = dt_value;
+	
+	if(of_property_read_s32(dev->of_node, "cal_offset_mC", &dt_value) == 0)
+		cal_offset_mC = dt_value;
+		
+	if(of_property_read_u32(dev->of_node, "cal_gain", &dt_value) == 0 && dt_value > 0)
+		cal_gain = dt_value;
+	
+	simtemp_read_lut(dev);
+	
+	/*Optional, cooling device bound to the thermal zone*/
+	if(of_property_read_string(dev->of_node, "cooling_device", &cdev_type) == 0)
+		strscpy(cooling_device, cdev_type, sizeof(cooling_device));
 				
 	simtemp_client = client;
+	
+	/*Register thermal zone with the limits from Device Tree*/
+	simtemp_thermal_register();
+	
+	/*Register IIO device*/
+	simtemp_iio_register(dev);
 		
 	return 0;
 }
@@ -503,6 +1290,8 @@ static int simtemp_probe(struct i2c_client *client)
 #ifndef SIM  
 static void simtemp_remove(struct i2c_client *client)
 {
+	simtemp_iio_unregister();
+	simtemp_thermal_unregister();
 }
 #endif
 
@@ -512,9 +1301,19 @@ static void simtemp_remove(struct i2c_client *client)
  ****************************************************************************/
 static int __init simtemp_init(void)
 {
+	/*Mutex initialization*/
+	mutex_init(&simtemp_mutex);
+	
+	/*Memory allocation for stats struct, before sysfs can read it*/
+	if((stats_storage = (struct stats*)kzalloc(sizeof(struct stats), GFP_KERNEL))==0){
+		printk(KERN_ERR "It is not possible to allocate memory in kernel\n");
+		return -1;
+	}
+	
 	/*Dynamic allocation of major and minor numbers for character device*/
 	if((alloc_chrdev_region(&simtemp, 0, 1, SIMTEMP_DEV))<0){
 		printk(KERN_ERR "It is not possible to allocate major and minor numbers\n");
+		kfree(stats_storage);
 		return -1;
 	}
 	
@@ -540,46 +1339,54 @@ static int __init simtemp_init(void)
 		goto rem_class;	
 	}
 
-#ifndef SIM	
-	/*Register i2c driver*/
-	if(i2c_add_driver(&simtemp_driver)){
-	  	printk(KERN_ERR "It is not possible to add the i2c driver\n");
-	  	goto rem_device;
-	}
-#endif	
-	
-	/*Mutex initialization*/
-	mutex_init(&simtemp_mutex);
-	
 	/*Create thread 1*/
 	simtemp_thread1 = kthread_create(thread_function_states,NULL,"simtemp_thread1");
-	if(!simtemp_thread1){
+	if(IS_ERR(simtemp_thread1)){
 		printk(KERN_ERR "Error creating the thread 1\n");
 		goto rem_device;
 	}
 	
 	/*Create thread 2*/
 	simtemp_thread2 = kthread_create(thread_function_temp_meas,NULL,"simtemp_thread2");
-	if(!simtemp_thread2){
+	if(IS_ERR(simtemp_thread2)){
 		printk(KERN_ERR "Error creating the thread 2\n");
-		goto rem_device;
+		goto rem_thread1;
+	}
+	/*Started now, it stays idle until a client or the IIO buffer needs samples*/
+	wake_up_process(simtemp_thread2);
+
+#ifndef SIM	
+	/*Register i2c driver, after the threads because the IIO buffer relies on thread 2*/
+	if(i2c_add_driver(&simtemp_driver)){
+	  	printk(KERN_ERR "It is not possible to add the i2c driver\n");
+	  	goto rem_threads;
 	}
+#endif	
 	
 #ifdef SIM	
-	/*Setting up the timer*/
+	/*Setting up the timer, started now so the thermal zone sees a changing value*/
 	timer_setup(&simtemp_timer, timer_callback, 0);
+	mod_timer(&simtemp_timer, jiffies + msecs_to_jiffies(TIMEOUT));
+	
+	/*Register thermal zone with the default limits*/
+	simtemp_thermal_register();
+	
+	/*Register IIO device*/
+	simtemp_iio_register(simtemp_sysdev);
 #endif
 
-	/*Memory allocation for stats struct*/
-	if((stats_storage = (struct stats*)kmalloc(sizeof(struct stats), GFP_KERNEL))==0){
-		printk(KERN_ERR "It is not possible to allocate memory in kernel\n");
-		goto rem_device;
-	}
-	
     printk(KERN_INFO "Init done\n");
     	 
 	return 0;
 	
+#ifndef SIM
+rem_threads:
+	kthread_stop(simtemp_thread2);
+#endif
+
+rem_thread1:
+	kthread_stop(simtemp_thread1);
+	
 rem_device:	
 	device_destroy(simtemp_class,simtemp);
 	
@@ -589,6 +1396,7 @@ rem_class:
 	
 rem_cdev:
 	unregister_chrdev_region(simtemp,1);
+	kfree(stats_storage);
 	
 	return -1;
 	
@@ -599,20 +1407,24 @@ rem_cdev:
  ****************************************************************************/
 static void __exit simtemp_exit(void)
 {
-	kfree(stats_storage);
 	state = 2;
     wake_up(&simtemp_wq_tout);
 	kthread_stop(simtemp_thread1);
 	kthread_stop(simtemp_thread2);
+#ifdef SIM
+	/*The callback rearms itself, wait for it and keep it from rearming*/
+	timer_shutdown_sync(&simtemp_timer);
+	simtemp_iio_unregister();
+	simtemp_thermal_unregister();
+#endif
 	device_destroy(simtemp_class,simtemp);
 	class_destroy(simtemp_class);
 	cdev_del(&simtemp_cdev);
 	unregister_chrdev_region(simtemp,1);
 #ifndef SIM	
 	i2c_del_driver(&simtemp_driver);
-#else	
-	del_timer(&simtemp_timer);
 #endif	
+	kfree(stats_storage);
 	printk(KERN_INFO "Exit done\n");
 }
 
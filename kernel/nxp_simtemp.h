@@ -1,7 +1,9 @@
 #ifndef SIMTEMP_H
 #define SIMTEMP_H
 
-/*Structure for data interchange between device and user space*/
+#include <linux/ioctl.h>
+
+/*Structure for data interchange between device and user space (ABI v1)*/
 
 typedef struct simtemp_sample {
     uint64_t timestamp_ns;
@@ -10,7 +12,63 @@ typedef struct simtemp_sample {
     unsigned short NEW_SAMPLE       :1;
     unsigned short LOW_TEMP_ALERT   :1;
     unsigned short HIGH_TEMP_ALERT  :1;
-    unsigned short                  :13;  
+    unsigned short PREDICT_ALERT    :1;
+    unsigned short                  :12;  
 } simtemp_sample;
 
+/*
+ * Sample ABI v2, fixed layout without bitfields or padding. The version is
+ * negotiated per open file with SIMTEMP_IOC_SET_ABI (v1 is the default),
+ * the driver returns -EINVAL for versions it does not support.
+ */
+#define SIMTEMP_ABI_V1              1
+#define SIMTEMP_ABI_V2              2
+
+#define SIMTEMP_FLAG_NEW_SAMPLE         (1u << 0)   /*woken by the sampling timeout*/
+#define SIMTEMP_FLAG_LOW_TEMP_ALERT     (1u << 1)
+#define SIMTEMP_FLAG_HIGH_TEMP_ALERT    (1u << 2)
+#define SIMTEMP_FLAG_PREDICT_ALERT      (1u << 3)
+
+typedef struct simtemp_sample_v2 {
+    uint16_t version;
+    uint16_t size;
+    uint32_t flags;
+    uint64_t seq;               /*+1 for every event raised (sampling timeout or alert), gaps are events not delivered to this reader*/
+    uint64_t timestamp_ns;      /*CLOCK_REALTIME*/
+    uint64_t mono_ns;           /*CLOCK_MONOTONIC*/
+    int32_t  temp_mC;
+    uint32_t sampling_ms;
+    uint32_t acq_ns;            /*duration of the sensor read*/
+    uint32_t reserved;
+} __attribute__((packed)) simtemp_sample_v2;
+
+#define SIMTEMP_IOC_MAGIC           's'
+#define SIMTEMP_IOC_SET_ABI         _IOW(SIMTEMP_IOC_MAGIC, 1, uint32_t)
+#define SIMTEMP_IOC_GET_ABI         _IOR(SIMTEMP_IOC_MAGIC, 2, uint32_t)
+
+/*Binary snapshot of configuration and stats (sysfs_snapshot attribute)*/
+#define SIMTEMP_SNAPSHOT_VERSION    2
+
+#define SIMTEMP_ERROR_NONE          0
+#define SIMTEMP_ERROR_LOW_TEMP      1
+#define SIMTEMP_ERROR_HIGH_TEMP     2
+
+typedef struct simtemp_snapshot {
+    uint32_t version;
+    uint32_t size;
+    int32_t  sampling_ms;
+    int32_t  htemp_mC;
+    int32_t  ltemp_mC;
+    int32_t  horizon_ms;
+    int32_t  last_temp_mC;
+    uint32_t last_error_type;
+    uint64_t last_error_ns;
+    char     mode[16];
+    /*Version 2*/
+    int32_t  cal_offset_mC;
+    int32_t  cal_gain;          /*Q16.16*/
+    uint32_t cal_lut_len;       /*points in the linearization table*/
+    uint32_t word_read;         /*1 if 16-bit reads are used*/
+} __attribute__((packed)) simtemp_snapshot;
+
 #endif //SIMTEMP_H
@@ -13,6 +13,9 @@ DT_IN="../kernel/dts/nxp_simtemp.dts"
 
 LKM_MAKEFILE_DIR="../kernel"
 
+#Set URING=1 to add the io_uring backend to the CLI (needs liburing)
+URING="${URING:-0}"
+
 mkdir -p "$OUTPUT" 
 
 #Create the .ko file
@@ -21,7 +24,11 @@ make -C "$LKM_MAKEFILE_DIR" build
 echo "Kernel module created successfully"
 
 #Compile the CLI
-"$COMPILER" -D REAL "$CFLAGS" "$SOURCE_APP" -o "$CLI"
+if [ "$URING" = "1" ]; then
+	"$COMPILER" -D REAL -D URING "$CFLAGS" "$SOURCE_APP" -o "$CLI" -luring
+else
+	"$COMPILER" -D REAL "$CFLAGS" "$SOURCE_APP" -o "$CLI"
+fi
 
 echo "CLI created successfully"
 
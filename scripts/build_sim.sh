@@ -11,13 +11,20 @@ KO_FILE="../kernel/nxp_simtemp.ko"
 
 LKM_MAKEFILE_DIR="../kernel"
 
+#Set URING=1 to add the io_uring backend to the CLI (needs liburing)
+URING="${URING:-0}"
+
 #Create the .ko file
 make -C "$LKM_MAKEFILE_DIR" sim_enabled
 
 echo "Kernel module created successfully"
 
 #Compile the CLI
-"$COMPILER" -D SIM "$CFLAGS" "$SOURCE_APP" -o "$CLI"
+if [ "$URING" = "1" ]; then
+	"$COMPILER" -D SIM -D URING "$CFLAGS" "$SOURCE_APP" -o "$CLI" -luring
+else
+	"$COMPILER" -D SIM "$CFLAGS" "$SOURCE_APP" -o "$CLI"
+fi
 
 echo "CLI created successfully"
 
@@ -9,14 +9,14 @@ fi
 
 ./simtemp --help
 sleep 1
-./simtemp load
+#load returns once /dev/simtemp exists, no need to wait
+sudo ./simtemp load
+sudo ./simtemp sampling 1000
 sleep 1
-./simtemp sampling 1000
-sleep 1
-./simtemp ltemp 5000
+sudo ./simtemp ltemp 5000
 sleep 1
 sudo ./simtemp run
 sleep 1
 ./simtemp stats
 sleep 1 
-./simtemp unload
+sudo ./simtemp unload
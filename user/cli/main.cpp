@@ -18,26 +18,112 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <fstream>
+#include <iterator>
+#include <elf.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <atomic>
+#include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <chrono>
 #include <ctime>
 #include <iomanip>
 #include <sstream>
 #include <iomanip>
 #include <thread>
+#ifdef URING
+#include <liburing.h>
+#endif
 #include "../../kernel/nxp_simtemp.h"
 
 /****************************************************************************
  * Definitions
  ****************************************************************************/
 #define FD_PATH   "/dev/simtemp"
-#define LOAD      "sudo insmod nxp_simtemp.ko"
-#define UNLOAD    "sudo rmmod nxp_simtemp"
-#define LOAD_DTOVERLAY "sudo dtoverlay nxp_simtemp.dtbo"
-#define UNLOAD_DTOVERLAY "sudo dtoverlay -r"
+#define SNAPSHOT_PATH "/sys/class/simtemp_class/simtemp/sysfs_snapshot"
+#define SYSFS_PATH "/sys/class/simtemp_class/simtemp/"
+#define KO_FILE   "nxp_simtemp.ko"
+#define MODULE_NAME "nxp_simtemp"
+#define DTBO_FILE "nxp_simtemp.dtbo"
+#define OVERLAY_PATH "/sys/kernel/config/device-tree/overlays/nxp_simtemp"
+#define DEV_TIMEOUT_MS 5000
+#ifndef MODULE_INIT_COMPRESSED_FILE
+#define MODULE_INIT_COMPRESSED_FILE 4
+#endif
+#ifdef URING
+#define URING_POLL  1ULL
+#define URING_READ  2ULL
+#endif
+#define SHM_NAME    "/simtemp_ring"
+#define SOCK_PATH   "/run/simtemp.sock"
+#define RING_MAGIC  0x53544d52
+#define RING_SLOTS  1024
+#define MAX_PENDING_CLIENTS 64
+#define CLIENT_TIMEOUT_MS   1000
+#define ATTACH_CHECK_MS     1000
+/*Fields of snapshot version 1, every later version only appends*/
+#define SNAPSHOT_V1_SIZE    offsetof(simtemp_snapshot, cal_offset_mC)
 
 using namespace std;
 
+/****************************************************************************
+ * Shared memory ring for serve/attach
+ ****************************************************************************/
+/*
+ * Written only by the serve process, clients get a read-only fd and map
+ * it read-only. Every slot is a seqlock: its seq is odd while the sample
+ * is written and 2*(n+1) once it holds sample n, so readers can detect a
+ * slot that was rewritten while they copied it. head is incremented after
+ * the slot, then seq is incremented and waiting readers are woken through
+ * a futex on it.
+ */
+struct ring_slot{
+    atomic<uint64_t> seq;
+    simtemp_sample_v2 sample;
+};
+
+struct shm_ring{
+    uint32_t magic;
+    uint32_t abi;
+    uint32_t slots;
+    atomic<uint32_t> seq;
+    atomic<uint64_t> head;
+    struct ring_slot entries[RING_SLOTS];
+};
+
+static_assert(atomic<uint32_t>::is_always_lock_free && atomic<uint64_t>::is_always_lock_free,
+	      "ring atomics are shared between processes");
+
+/*
+ * Client connection of serve. After the handshake the socket stays open
+ * without traffic, clients poll it to know if serve is still running.
+ */
+struct ring_client{
+    int fd;
+    uint32_t hello;
+    size_t received;
+    bool attached;
+    chrono::steady_clock::time_point since;
+};
+
+/*Sent by the server after the client hello, with the ring fd attached*/
+struct ring_handshake{
+    uint32_t magic;
+    uint32_t abi;
+    uint32_t slots;
+    uint32_t size;
+};
+
 /****************************************************************************
  * Class for CLI functions
  ****************************************************************************/
@@ -56,6 +142,21 @@ public:
 	return true;
     }
 
+    bool isSignedInteger(const string &s){
+	if(!s.empty() && s[0] == '-')
+	    return s.size() > 1 && isInteger(s.substr(1));
+	return !s.empty() && isInteger(s);
+    }
+
+    /*The driver already gives calibrated millidegrees, only format them*/
+    string format_millidegrees(int32_t temp_mC){
+	ostringstream oss;
+	uint32_t abs_mC = temp_mC < 0 ? -static_cast<int64_t>(temp_mC) : temp_mC;
+
+	oss << (temp_mC < 0 ? "-" : "") << abs_mC/1000 << "." << setw(3) << setfill('0') << abs_mC%1000;
+	return oss.str();
+    }
+
     string format_nanoseconds_to_datetime(long long nanoseconds_since_epoch) {
 	chrono::nanoseconds ns_duration(nanoseconds_since_epoch);
 	chrono::time_point<chrono::system_clock, chrono::nanoseconds> 
@@ -71,66 +172,752 @@ public:
 
     
     void run(void){
-        simtemp_sample result;
-	struct pollfd pfd;
-	float temp_float;
+        simtemp_sample_v2 result;
+        simtemp_sample result_v1;
+	uint64_t last_seq = 0;
+	bool abi_v2;
+	ssize_t n;
 	load_file_descriptor();
 	int counter=0;
 	char run_buf[1]={'s'};  
 	write(fd, run_buf, strlen(run_buf)+1);   
-	    
-        pfd.fd = fd;
-        pfd.events = POLLIN;
 
-	
+	/*Older drivers only know the v1 layout*/
+	abi_v2 = (set_abi(fd, SIMTEMP_ABI_V2) == 0);
+
+	/*read blocks until the next sample or alert*/
 #ifdef DEMO
 	while(counter<30){
-	   if(poll(&pfd, 1, -1)==1){	
 #else	        
 	while (1) {
-	   poll(&pfd, 1, -1);	
 #endif
-	    if(pfd.revents & POLLIN){
-		counter++;
-		read(fd, &result, sizeof(result));
-	    
-		temp_float = static_cast<float>(result.temp_mC); 	
-		temp_float/=1000;
-		std::string sample_time = format_nanoseconds_to_datetime(result.timestamp_ns);
-			    
-		cout << sample_time 
-		<< "   temp=" << fixed << setprecision(1) << temp_float <<"°C"
-		<<"   high temp alert="<< result.HIGH_TEMP_ALERT
-		<<"   low temp alert="<< result.LOW_TEMP_ALERT<<endl;
-	    }
-#ifdef DEMO	    
-         }	
+	    if(abi_v2){
+		n = read(fd, &result, sizeof(result));
+	    }
 	    else{
+		n = read(fd, &result_v1, sizeof(result_v1));
+		if(n == sizeof(result_v1)){
+		    sample_from_v1(result_v1, result);
+		    n = sizeof(result);
+		}
+	    }
+	    if(n != sizeof(result)){
+		if(n < 0 && errno == EINTR)
+		    continue;
+		cout << "Error reading the device file" << endl;
 		close(fd);
 		exit(1);
+	    }
+	    counter++;
+	    print_sample(result, "", last_seq);
+	}
+	close(fd);
+    }
+
+    int set_abi(int dev_fd, uint32_t abi){
+	return ioctl(dev_fd, SIMTEMP_IOC_SET_ABI, &abi);
+    }
+
+    void sample_from_v1(const simtemp_sample &v1, simtemp_sample_v2 &v2){
+	memset(&v2, 0, sizeof(v2));
+	v2.version = SIMTEMP_ABI_V1;
+	v2.size = sizeof(v1);
+	v2.timestamp_ns = v1.timestamp_ns;
+	v2.temp_mC = v1.temp_mC;
+	v2.sampling_ms = v1.sampling_ms;
+	v2.flags = (v1.NEW_SAMPLE ? SIMTEMP_FLAG_NEW_SAMPLE : 0) |
+		   (v1.LOW_TEMP_ALERT ? SIMTEMP_FLAG_LOW_TEMP_ALERT : 0) |
+		   (v1.HIGH_TEMP_ALERT ? SIMTEMP_FLAG_HIGH_TEMP_ALERT : 0) |
+		   (v1.PREDICT_ALERT ? SIMTEMP_FLAG_PREDICT_ALERT : 0);
+    }
+
+    /*last_seq keeps the sequence number of the previous sample of the same device*/
+    void print_sample(const simtemp_sample_v2 &result, const string &device, uint64_t &last_seq){
+	std::string sample_time = format_nanoseconds_to_datetime(result.timestamp_ns);
+
+	if(!device.empty())
+	    cout << device << "   ";
+	cout << sample_time 
+	<< "   temp=" << format_millidegrees(result.temp_mC) <<"°C"
+	<<"   high temp alert="<< ((result.flags & SIMTEMP_FLAG_HIGH_TEMP_ALERT) ? 1 : 0)
+	<<"   low temp alert="<< ((result.flags & SIMTEMP_FLAG_LOW_TEMP_ALERT) ? 1 : 0)
+	<<"   predicted alert="<< ((result.flags & SIMTEMP_FLAG_PREDICT_ALERT) ? 1 : 0);
+	if(result.version >= SIMTEMP_ABI_V2){
+	    cout << "   seq=" << result.seq
+	    << "   acq=" << fixed << setprecision(1) << result.acq_ns/1000.0 << "us";
+	    if(last_seq != 0 && result.seq > last_seq + 1)
+		cout << "   missed=" << result.seq - last_seq - 1;
+	    last_seq = result.seq;
+	}
+	cout << endl;
+    }
+
+    /*
+     * Single reader of the device, publishes every sample in a shared
+     * memory ring. Clients connect to SOCK_PATH, send RING_MAGIC and
+     * receive a read-only fd of the ring, then read the samples without
+     * going through the device or this process. Client sockets are
+     * non-blocking and handled in the same poll as the device, so a slow
+     * client never delays publishing. They are kept open until the client
+     * closes them.
+     */
+    void serve(void){
+	vector<struct pollfd> pfds;
+	vector<ring_client> clients;
+	struct sockaddr_un addr;
+	struct shm_ring *ring;
+	simtemp_sample_v2 result;
+	char run_buf[1]={'s'};
+	char ro_path[64];
+	int shm_fd, ro_fd, sock_fd, timeout;
+	ssize_t n;
+
+	load_file_descriptor();
+	write(fd, run_buf, sizeof(run_buf));
+	if(set_abi(fd, SIMTEMP_ABI_V2) < 0){
+	    cout << "Sample ABI v2 not supported by the driver" << endl;
+	    exit(1);
+	}
+
+	/*The name is removed right away, clients get the fd over the socket*/
+	shm_fd = shm_open(SHM_NAME, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if(shm_fd < 0){
+	    print_error("Error creating shared memory");
+	    exit(1);
+	}
+	shm_unlink(SHM_NAME);
+	if(ftruncate(shm_fd, sizeof(struct shm_ring)) < 0){
+	    print_error("Error sizing shared memory");
+	    exit(1);
+	}
+	ring = static_cast<struct shm_ring *>(mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0));
+	if(ring == MAP_FAILED){
+	    print_error("Error mapping shared memory");
+	    exit(1);
+	}
+	ring->magic = RING_MAGIC;
+	ring->abi = SIMTEMP_ABI_V2;
+	ring->slots = RING_SLOTS;
+
+	/*Read-only descriptor of the same object, the only one given to clients*/
+	snprintf(ro_path, sizeof(ro_path), "/proc/self/fd/%d", shm_fd);
+	ro_fd = open(ro_path, O_RDONLY | O_CLOEXEC);
+	if(ro_fd < 0){
+	    print_error("Error reopening shared memory read-only");
+	    exit(1);
+	}
+	close(shm_fd);
+
+	sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(sock_fd < 0){
+	    print_error("Error creating socket");
+	    exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCK_PATH, sizeof(addr.sun_path) - 1);
+	unlink(SOCK_PATH);
+	if(bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock_fd, 16) < 0){
+	    print_error("Error listening on " SOCK_PATH);
+	    exit(1);
+	}
+	chmod(SOCK_PATH, 0666);
+
+	cout << "Serving samples on " << SOCK_PATH << endl;
+
+	while(1){
+	    pfds.clear();
+	    pfds.push_back({fd, POLLIN, 0});
+	    pfds.push_back({sock_fd, POLLIN, 0});
+	    timeout = -1;
+	    for(const ring_client &c : clients){
+		pfds.push_back({c.fd, POLLIN, 0});
+		if(!c.attached)
+		    timeout = CLIENT_TIMEOUT_MS;
+	    }
+
+	    if(poll(pfds.data(), pfds.size(), timeout) < 0){
+		if(errno == EINTR)
+		    continue;
+		print_error("Error in poll");
+		break;
+	    }
+
+	    if(pfds[0].revents & POLLIN){
+		n = read(fd, &result, sizeof(result));
+		if(n == sizeof(result))
+		    publish_sample(ring, result);
+		else if(n < 0 && errno != EINTR && errno != EAGAIN){
+		    print_error("Error reading the device file");
+		    break;
+		}
+	    }
+
+	    /*Walk backwards, closed clients are removed from the vector*/
+	    for(size_t i = clients.size(); i-- > 0;){
+		bool done = false;
+		if(clients[i].attached)
+		    /*Attached clients send nothing, readable means closed*/
+		    done = pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR);
+		else if(pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+		    done = client_hello(clients[i], ro_fd);
+		else if(chrono::steady_clock::now() - clients[i].since > chrono::milliseconds(CLIENT_TIMEOUT_MS))
+		    done = true;
+		if(done){
+		    close(clients[i].fd);
+		    clients.erase(clients.begin() + i);
 		}
-#endif	    
+	    }
+
+	    if(pfds[1].revents & POLLIN)
+		accept_clients(sock_fd, clients);
 	}
+
+	for(const ring_client &c : clients)
+	    close(c.fd);
+	close(sock_fd);
+	unlink(SOCK_PATH);
+	munmap(ring, sizeof(struct shm_ring));
+	close(ro_fd);
 	close(fd);
     }
 
-    int send_command(const char *command){
-	int status = system(command);
-		    
-	if(status == -1)
+    void publish_sample(struct shm_ring *ring, const simtemp_sample_v2 &sample){
+	uint64_t head = ring->head.load(memory_order_relaxed);
+	struct ring_slot &slot = ring->entries[head % RING_SLOTS];
+
+	/*The odd seq must be visible before any byte of the new sample*/
+	slot.seq.store(2*head + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot.sample = sample;
+	slot.seq.store(2*head + 2, memory_order_release);
+	ring->head.store(head + 1, memory_order_release);
+	ring->seq.fetch_add(1, memory_order_release);
+	syscall(SYS_futex, &ring->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+    /*Connections beyond MAX_PENDING_CLIENTS in handshake are closed right away*/
+    void accept_clients(int sock_fd, vector<ring_client> &clients){
+	size_t pending = 0;
+	int client_fd;
+
+	for(const ring_client &c : clients)
+	    if(!c.attached)
+		pending++;
+
+	while((client_fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0){
+	    if(pending >= MAX_PENDING_CLIENTS){
+		close(client_fd);
+		continue;
+	    }
+	    clients.push_back({client_fd, 0, 0, false, chrono::steady_clock::now()});
+	    pending++;
+	}
+    }
+
+    /*Returns true when the client must be closed, attached clients are kept*/
+    bool client_hello(ring_client &client, int ro_fd){
+	struct ring_handshake hs = {RING_MAGIC, SIMTEMP_ABI_V2, RING_SLOTS, sizeof(struct shm_ring)};
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t n;
+
+	n = recv(client.fd, reinterpret_cast<char *>(&client.hello) + client.received,
+		 sizeof(client.hello) - client.received, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
+	    return false;
+	if(n <= 0)
+	    return true;
+	client.received += n;
+	if(client.received < sizeof(client.hello))
+	    return false;
+	if(client.hello != RING_MAGIC)
+	    return true;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &hs;
+	iov.iov_len = sizeof(hs);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &ro_fd, sizeof(int));
+	/*Fits in an empty socket buffer, a failure just drops the client*/
+	if(sendmsg(client.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(hs))
+	    return true;
+	client.attached = true;
+	return false;
+    }
+
+    /*serve never writes after the handshake, so a readable socket means it is gone*/
+    bool server_gone(int sock_fd){
+	struct pollfd pfd = {sock_fd, POLLIN, 0};
+
+	return poll(&pfd, 1, 0) > 0;
+    }
+
+    /*Client of serve, reads the samples from the shared memory ring*/
+    void attach(void){
+	struct sockaddr_un addr;
+	struct ring_handshake hs;
+	struct shm_ring *ring;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	simtemp_sample_v2 result;
+	struct timespec wait_ts = {ATTACH_CHECK_MS / 1000, (ATTACH_CHECK_MS % 1000) * 1000000L};
+	uint32_t hello = RING_MAGIC;
+	uint64_t next, head, slot_seq, last_seq = 0;
+	uint32_t seq;
+	int sock_fd, shm_fd = -1;
+
+	sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCK_PATH, sizeof(addr.sun_path) - 1);
+	if(sock_fd < 0 || connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+	    print_error("Error connecting to " SOCK_PATH);
+	    exit(1);
+	}
+	write(sock_fd, &hello, sizeof(hello));
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hs;
+	iov.iov_len = sizeof(hs);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if(recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(hs)){
+	    print_error("Error in handshake");
+	    exit(1);
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	    memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+	if(shm_fd < 0 || hs.magic != RING_MAGIC || hs.abi != SIMTEMP_ABI_V2 ||
+	   hs.slots != RING_SLOTS || hs.size != sizeof(struct shm_ring)){
+	    cout << "Unsupported ring format" << endl;
+	    exit(1);
+	}
+
+	ring = static_cast<struct shm_ring *>(mmap(NULL, sizeof(struct shm_ring), PROT_READ, MAP_SHARED, shm_fd, 0));
+	close(shm_fd);
+	if(ring == MAP_FAILED){
+	    print_error("Error mapping shared memory");
+	    exit(1);
+	}
+
+	/*Start with the next published sample*/
+	next = ring->head.load(memory_order_acquire);
+	while(1){
+	    seq = ring->seq.load(memory_order_acquire);
+	    head = ring->head.load(memory_order_acquire);
+
+	    if(next == head){
+		/*Timed, so a serve that exited without waking us is noticed*/
+		if(syscall(SYS_futex, &ring->seq, FUTEX_WAIT, seq, &wait_ts, NULL, 0) < 0 &&
+		   errno == ETIMEDOUT && server_gone(sock_fd))
+		    break;
+		continue;
+	    }
+
+	    /*Too slow, the oldest samples were overwritten (reported as missed)*/
+	    if(head - next > RING_SLOTS)
+		next = head - RING_SLOTS;
+
+	    struct ring_slot &slot = ring->entries[next % RING_SLOTS];
+	    slot_seq = slot.seq.load(memory_order_acquire);
+	    result = slot.sample;
+	    atomic_thread_fence(memory_order_acquire);
+	    /*The slot was rewritten before or while copying it, skip to the oldest sample left*/
+	    if(slot_seq != 2*next + 2 || slot.seq.load(memory_order_relaxed) != slot_seq){
+		next = ring->head.load(memory_order_acquire) - RING_SLOTS + 1;
+		continue;
+	    }
+	    next++;
+	    print_sample(result, "", last_seq);
+	}
+
+	cout << "The server is not running anymore" << endl;
+	munmap(ring, sizeof(struct shm_ring));
+	close(sock_fd);
+	exit(1);
+    }
+
+#ifdef URING
+    /*
+     * Drains one or many device nodes through io_uring. Every device has a
+     * multishot poll armed once, and a fixed read into its registered buffer
+     * is queued each time it becomes readable. All the reads of a batch are
+     * submitted by the same io_uring_submit_and_wait call, so the number of
+     * syscalls does not depend on how many devices are ready.
+     */
+    void run_uring(const vector<string> &devices){
+	struct io_uring ring;
+	struct io_uring_cqe *cqe;
+	unsigned int head, seen;
+	size_t n_dev = devices.size();
+	vector<int> fds(n_dev, -1);
+	vector<simtemp_sample_v2> samples(n_dev);
+	vector<uint64_t> last_seq(n_dev, 0);
+	vector<bool> reading(n_dev, false);
+	vector<bool> ready(n_dev, false);
+	vector<struct iovec> iovs(n_dev);
+	char run_buf[1]={'s'};
+	int ret;
+
+	ret = io_uring_queue_init(2*n_dev < 8 ? 8 : 2*n_dev, &ring, 0);
+	if(ret < 0){
+	    cout << "Error setting up io_uring: " << strerror(-ret) << endl;
+	    exit(1);
+	}
+
+	for(size_t i=0; i<n_dev; i++){
+	    /*
+	     * With O_NONBLOCK io_uring issues the reads inline instead of
+	     * handing them to io-wq workers, and a read that finds nothing
+	     * pending (another reader took the sample) does not block.
+	     */
+	    fds[i] = open(devices[i].c_str(), O_RDWR | O_NONBLOCK);
+	    if(fds[i] < 0){
+		cout << "Error opening the device file " << devices[i] << endl;
+		exit(1);
+	    }
+	    write(fds[i], run_buf, sizeof(run_buf));
+	    if(set_abi(fds[i], SIMTEMP_ABI_V2) < 0){
+		cout << "Sample ABI v2 not supported by " << devices[i] << endl;
+		exit(1);
+	    }
+	    iovs[i].iov_base = &samples[i];
+	    iovs[i].iov_len = sizeof(simtemp_sample_v2);
+	}
+
+	ret = io_uring_register_buffers(&ring, iovs.data(), n_dev);
+	if(ret < 0){
+	    cout << "Error registering buffers: " << strerror(-ret) << endl;
+	    exit(1);
+	}
+
+	for(size_t i=0; i<n_dev; i++)
+	    queue_uring_poll(&ring, fds[i], i);
+
+	while(1){
+	    ret = io_uring_submit_and_wait(&ring, 1);
+	    if(ret < 0 && ret != -EINTR){
+		cout << "Error waiting for io_uring: " << strerror(-ret) << endl;
+		break;
+	    }
+
+	    seen = 0;
+	    io_uring_for_each_cqe(&ring, head, cqe){
+		uint64_t data = io_uring_cqe_get_data64(cqe);
+		size_t idx = data >> 8;
+		seen++;
+
+		if((data & 0xff) == URING_POLL){
+		    /*Multishot poll stops on errors or overflow, arm it again*/
+		    if(!(cqe->flags & IORING_CQE_F_MORE))
+			queue_uring_poll(&ring, fds[idx], idx);
+		    if(cqe->res < 0)
+			continue;
+		    /*The buffer is in use, read again when the current read completes*/
+		    if(reading[idx]){
+			ready[idx] = true;
+			continue;
+		    }
+		    queue_uring_read(&ring, fds[idx], &samples[idx], idx);
+		    reading[idx] = true;
+		}
+		else{
+		    reading[idx] = false;
+		    if(cqe->res == sizeof(simtemp_sample_v2))
+			print_sample(samples[idx], n_dev > 1 ? devices[idx] : "", last_seq[idx]);
+		    /*-EAGAIN, nothing pending anymore, wait for the next poll CQE*/
+		    else if(cqe->res < 0 && cqe->res != -EAGAIN)
+			cout << "Error reading " << devices[idx] << ": " << strerror(-cqe->res) << endl;
+		    /*The device became readable again while reading, do not wait for another event*/
+		    if(ready[idx]){
+			ready[idx] = false;
+			queue_uring_read(&ring, fds[idx], &samples[idx], idx);
+			reading[idx] = true;
+		    }
+		}
+	    }
+	    io_uring_cq_advance(&ring, seen);
+	}
+
+	io_uring_queue_exit(&ring);
+	for(size_t i=0; i<n_dev; i++)
+	    close(fds[i]);
+    }
+
+    struct io_uring_sqe *get_uring_sqe(struct io_uring *ring){
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+
+	/*Submission queue full, flush it without waiting*/
+	if(!sqe){
+	    io_uring_submit(ring);
+	    sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+    }
+
+    void queue_uring_poll(struct io_uring *ring, int dev_fd, size_t idx){
+	struct io_uring_sqe *sqe = get_uring_sqe(ring);
+
+	io_uring_prep_poll_multishot(sqe, dev_fd, POLLIN);
+	io_uring_sqe_set_data64(sqe, (idx << 8) | URING_POLL);
+    }
+
+    void queue_uring_read(struct io_uring *ring, int dev_fd, simtemp_sample_v2 *sample, size_t idx){
+	struct io_uring_sqe *sqe = get_uring_sqe(ring);
+
+	io_uring_prep_read_fixed(sqe, dev_fd, sample, sizeof(simtemp_sample_v2), 0, idx);
+	io_uring_sqe_set_data64(sqe, (idx << 8) | URING_READ);
+    }
+#endif
+
+    int print_error(const string &message){
+	cout << message << ": " << strerror(errno) << endl;
+	return -1;
+    }
+
+    /*Applies the overlay through the configfs interface of device tree overlays*/
+    int load_overlay(){
+	vector<char> dtbo;
+	char chunk[4096];
+	char status[16] = {0};
+	ssize_t n;
+	int in_fd, out_fd;
+
+	in_fd = open(DTBO_FILE, O_RDONLY | O_CLOEXEC);
+	if(in_fd < 0)
+	    return print_error("Error opening " DTBO_FILE);
+	while((n = read(in_fd, chunk, sizeof(chunk))) > 0)
+	    dtbo.insert(dtbo.end(), chunk, chunk + n);
+	close(in_fd);
+	if(n < 0)
+	    return print_error("Error reading " DTBO_FILE);
+
+	if(mkdir(OVERLAY_PATH, 0755) < 0)
+	    return print_error("Error creating the overlay directory");
+
+	out_fd = open(OVERLAY_PATH "/dtbo", O_WRONLY | O_CLOEXEC);
+	if(out_fd < 0){
+	    print_error("Error opening the overlay dtbo");
+	    rmdir(OVERLAY_PATH);
 	    return -1;
-	else if(WIFEXITED(status) && WEXITSTATUS(status) != 0)
+	}
+	n = write(out_fd, dtbo.data(), dtbo.size());
+	close(out_fd);
+	if(n != static_cast<ssize_t>(dtbo.size())){
+	    print_error("Error applying the overlay");
+	    rmdir(OVERLAY_PATH);
 	    return -1;
+	}
+
+	if(read_attribute(OVERLAY_PATH "/status", status, sizeof(status)-1) < 0 || strncmp(status, "applied", 7) != 0){
+	    cout << "The overlay was not applied" << endl;
+	    rmdir(OVERLAY_PATH);
+	    return -1;
+	}
+	return 0;
+    }	
+
+    /*Module name from a path in modules.dep or a depends= entry, '-' and '_' are the same*/
+    string module_name(const string &path){
+	string name = path.substr(path.find_last_of('/') + 1);
+	name = name.substr(0, name.find(".ko"));
+	for(char &c : name)
+	    if(c == '-')
+		c = '_';
+	return name;
+    }
+
+    int load_module_file(const string &path){
+	string name = module_name(path);
+	int flags = 0;
+	int ko_fd;
+
+	if(access(("/sys/module/" + name).c_str(), F_OK) == 0)
+	    return 0;
+	if(path.size() < 3 || path.compare(path.size() - 3, 3, ".ko") != 0)
+	    flags = MODULE_INIT_COMPRESSED_FILE;
+
+	ko_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(ko_fd < 0)
+	    return print_error("Error opening " + path);
+	if(syscall(SYS_finit_module, ko_fd, "", flags) < 0 && errno != EEXIST){
+	    print_error("Error loading " + name);
+	    close(ko_fd);
+	    return -1;
+	}
+	close(ko_fd);
+	return 0;
+    }
+
+    /*Contents of a section of an ELF file, empty if it is not found*/
+    template<class Ehdr, class Shdr>
+    string elf_section(const string &elf, const char *name){
+	const Ehdr *eh = reinterpret_cast<const Ehdr *>(elf.data());
+	const Shdr *sh, *strtab;
+
+	if(elf.size() < sizeof(Ehdr) || eh->e_shentsize != sizeof(Shdr) || eh->e_shstrndx >= eh->e_shnum ||
+	   eh->e_shoff > elf.size() || eh->e_shnum > (elf.size() - eh->e_shoff) / sizeof(Shdr))
+	    return "";
+	sh = reinterpret_cast<const Shdr *>(elf.data() + eh->e_shoff);
+	strtab = &sh[eh->e_shstrndx];
+	if(strtab->sh_offset > elf.size() || strtab->sh_size > elf.size() - strtab->sh_offset)
+	    return "";
+
+	for(int i=0; i<eh->e_shnum; i++){
+	    if(sh[i].sh_name >= strtab->sh_size || sh[i].sh_offset > elf.size() || sh[i].sh_size > elf.size() - sh[i].sh_offset)
+		continue;
+	    if(strncmp(elf.data() + strtab->sh_offset + sh[i].sh_name, name, strtab->sh_size - sh[i].sh_name) == 0)
+		return elf.substr(sh[i].sh_offset, sh[i].sh_size);
+	}
+	return "";
+    }
+
+    /*Modules listed by modpost in the depends= entry of the .modinfo section*/
+    vector<string> module_depends(const char *path){
+	ifstream ko(path, ios::binary);
+	string elf((istreambuf_iterator<char>(ko)), istreambuf_iterator<char>());
+	string modinfo, entry, name;
+	vector<string> names;
+
+	if(elf.size() < EI_NIDENT || memcmp(elf.data(), ELFMAG, SELFMAG) != 0)
+	    return names;
+	if(elf[EI_CLASS] == ELFCLASS64)
+	    modinfo = elf_section<Elf64_Ehdr, Elf64_Shdr>(elf, ".modinfo");
 	else
-	    return 0;	
+	    modinfo = elf_section<Elf32_Ehdr, Elf32_Shdr>(elf, ".modinfo");
+
+	istringstream entries(modinfo);
+	while(getline(entries, entry, '\0')){
+	    if(entry.compare(0, 8, "depends=") != 0)
+		continue;
+	    istringstream list(entry.substr(8));
+	    while(getline(list, name, ','))
+		if(!name.empty())
+		    names.push_back(module_name(name));
+	}
+	return names;
     }
 
-    int load_overlay(){
-	return send_command(LOAD_DTOVERLAY);
-    }	
+    /*
+     * finit_module does not resolve dependencies like modprobe, so the
+     * modules the driver imports symbols from (depends= in its .modinfo)
+     * are loaded first, with their own dependencies taken from
+     * modules.dep. Modules not listed there are built-in and are skipped.
+     */
+    int load_dependencies(){
+	struct utsname uts;
+	string base, line, target;
+	vector<string> depends = module_depends(KO_FILE);
+
+	if(depends.empty())
+	    return 0;
+	if(uname(&uts) < 0)
+	    return print_error("Error getting kernel release");
+	base = string("/lib/modules/") + uts.release + "/";
+	ifstream dep(base + "modules.dep");
+	if(!dep)
+	    return 0;
+
+	while(getline(dep, line)){
+	    size_t colon = line.find(':');
+	    if(colon == string::npos)
+		continue;
+	    target = line.substr(0, colon);
+	    bool wanted = false;
+	    for(const string &m : depends)
+		if(module_name(target) == m)
+		    wanted = true;
+	    if(!wanted)
+		continue;
+
+	    /*Dependencies are listed last-loaded first*/
+	    vector<string> deps;
+	    istringstream iss(line.substr(colon + 1));
+	    string d;
+	    while(iss >> d)
+		deps.push_back(d);
+	    for(auto it = deps.rbegin(); it != deps.rend(); ++it)
+		if(load_module_file(base + *it) < 0)
+		    return -1;
+	    if(load_module_file(base + target) < 0)
+		return -1;
+	}
+	return 0;
+    }
 
     int load_driver(){	
-	return send_command(LOAD);
+	int ko_fd;
+
+	if(load_dependencies() < 0)
+	    return -1;
+
+	ko_fd = open(KO_FILE, O_RDONLY | O_CLOEXEC);
+	if(ko_fd < 0)
+	    return print_error("Error opening " KO_FILE);
+
+	if(syscall(SYS_finit_module, ko_fd, "", 0) < 0){
+	    print_error("Error loading the driver");
+	    close(ko_fd);
+	    return -1;
+	}
+	close(ko_fd);
+
+	return wait_for_device(FD_PATH, DEV_TIMEOUT_MS);
+    }
+
+    /*Waits until udev creates the device file, watching /dev with inotify*/
+    int wait_for_device(const char *path, int timeout_ms){
+	struct pollfd pfd;
+	char events[4096];
+	int ret = -1;
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+
+	pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if(pfd.fd < 0)
+	    return print_error("Error creating inotify instance");
+	pfd.events = POLLIN;
+
+	/*Check after adding the watch, so the creation cannot be missed*/
+	if(inotify_add_watch(pfd.fd, "/dev", IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0){
+	    print_error("Error watching /dev");
+	    close(pfd.fd);
+	    return -1;
+	}
+
+	while(1){
+	    if(access(path, R_OK | W_OK) == 0){
+		ret = 0;
+		break;
+	    }
+	    int remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+	    if(remaining <= 0){
+		cout << "Timeout waiting for " << path << endl;
+		break;
+	    }
+	    if(poll(&pfd, 1, remaining) < 0 && errno != EINTR){
+		print_error("Error waiting for the device file");
+		break;
+	    }
+	    while(read(pfd.fd, events, sizeof(events)) > 0);
+	}
+	close(pfd.fd);
+	return ret;
     }
 
     int load_file_descriptor(){
@@ -143,53 +930,133 @@ public:
     }
 
     int unload_overlay(){
-	return send_command(UNLOAD_DTOVERLAY);
+	if(rmdir(OVERLAY_PATH) < 0)
+	    return print_error("Error removing the overlay");
+	return 0;
     }
 
     int unload_driver(){
-	return send_command(UNLOAD);
+	if(syscall(SYS_delete_module, MODULE_NAME, O_NONBLOCK) < 0)
+	    return print_error("Error unloading the driver");
+	return 0;
+    }
+
+    int write_attribute(const char *name, const string &value){
+	string path = string(SYSFS_PATH) + name;
+	int attr_fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if(attr_fd < 0)
+	    return print_error("Error opening " + path);
+	n = write(attr_fd, value.c_str(), value.size());
+	close(attr_fd);
+	if(n != static_cast<ssize_t>(value.size()))
+	    return print_error("Error writing " + path);
+	return 0;
+    }
+
+    ssize_t read_attribute(const char *path, char *buf, size_t len){
+	int attr_fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t n;
+
+	if(attr_fd < 0)
+	    return print_error("Error opening " + string(path));
+	n = read(attr_fd, buf, len);
+	close(attr_fd);
+	if(n < 0)
+	    return print_error("Error reading " + string(path));
+	return n;
     }
 
     void set_sampling(int value){
-	    string command;
 	    cout<<"Setting sampling: " << value << endl;
-	    command = "echo "+ std::to_string(value) + " > /sys/class/simtemp_class/simtemp/sysfs_sampling_ms";
-	    send_command(command.c_str());
+	    write_attribute("sysfs_sampling_ms", std::to_string(value));
     }
 
     void set_htemp(int value){
-	    string command;
 	    cout<<"Setting value for high temperature alert: " << value << endl;
-	    command = "echo "+ std::to_string(value) + " > /sys/class/simtemp_class/simtemp/sysfs_htemp_mC";
-	    send_command(command.c_str());
+	    write_attribute("sysfs_htemp_mC", std::to_string(value));
     }
 
     void set_ltemp(int value){
-	    string command;
 	    cout<<"Setting value for low temperature alert: " << value << endl;
-	    command = "echo "+ std::to_string(value) + " > /sys/class/simtemp_class/simtemp/sysfs_ltemp_mC";
-	    send_command(command.c_str());
+	    write_attribute("sysfs_ltemp_mC", std::to_string(value));
+    }
+
+    void set_horizon(int value){
+	    cout<<"Setting horizon for predicted alert: " << value << endl;
+	    write_attribute("sysfs_horizon_ms", std::to_string(value));
+    }
+
+    void set_cal_offset(int value){
+	    cout<<"Setting calibration offset: " << value << endl;
+	    write_attribute("sysfs_cal_offset_mC", std::to_string(value));
+    }
+
+    void set_cal_gain(int value){
+	    cout<<"Setting calibration gain: " << value << endl;
+	    write_attribute("sysfs_cal_gain", std::to_string(value));
     }
 
     void set_mode(string value){
-	    string command;
 	    cout<<"Setting mode: " << value << endl;
-	    command = "echo "+ value + " > /sys/class/simtemp_class/simtemp/sysfs_mode";
-	    send_command(command.c_str());
+	    write_attribute("sysfs_mode", value + "\n");
     }
 
     void get_mode(){
-	    string command;
+	    char mode[32] = {0};
 	    cout<<"Getting mode: " << endl;
-	    command = "cat /sys/class/simtemp_class/simtemp/sysfs_mode";
-	    send_command(command.c_str());
+	    if(read_attribute(SYSFS_PATH "sysfs_mode", mode, sizeof(mode)-1) >= 0)
+		cout << mode;
     }
 
+    /*Prints the fields present in the snapshot, older or newer versions are accepted*/
     void get_stats(){
-	    string command;
+	    simtemp_snapshot snap;
+	    string mode;
+	    string error_type;
+	    int snap_fd;
+	    ssize_t n;
+	    size_t avail;
+
+	    snap_fd = open(SNAPSHOT_PATH, O_RDONLY);
+	    if(snap_fd < 0){
+		cout << "Error opening the snapshot attribute" << endl;
+		return;
+	    }
+	    memset(&snap, 0, sizeof(snap));
+	    n = read(snap_fd, &snap, sizeof(snap));
+	    close(snap_fd);
+	    if(n < static_cast<ssize_t>(SNAPSHOT_V1_SIZE) || snap.version < 1 || snap.size < SNAPSHOT_V1_SIZE){
+		cout << "Unsupported snapshot format" << endl;
+		return;
+	    }
+	    avail = min(static_cast<size_t>(n), static_cast<size_t>(snap.size));
+
+	    mode.assign(snap.mode, strnlen(snap.mode, sizeof(snap.mode)));
+	    if(!mode.empty() && mode.back() == '\n')
+		mode.pop_back();
+	    if(snap.last_error_type == SIMTEMP_ERROR_LOW_TEMP)
+		error_type = "Low temperature";
+	    else if(snap.last_error_type == SIMTEMP_ERROR_HIGH_TEMP)
+		error_type = "High temperature";
+
 	    cout<<"Statistics: " << endl;
-	    command = "cat /sys/class/simtemp_class/simtemp/sysfs_stats";
-	    send_command(command.c_str());
+	    cout << "Sampling: " << snap.sampling_ms << " ms" << endl;
+	    cout << "High temperature alert: " << snap.htemp_mC << " mC" << endl;
+	    cout << "Low temperature alert: " << snap.ltemp_mC << " mC" << endl;
+	    cout << "Predicted alert horizon: " << snap.horizon_ms << " ms" << endl;
+	    cout << "Mode: " << mode << endl;
+	    cout << "Last temperature: " << snap.last_temp_mC << " mC" << endl;
+	    if(avail >= offsetof(simtemp_snapshot, word_read) + sizeof(snap.word_read))
+		cout << "Calibration: offset " << snap.cal_offset_mC << " mC, gain " << snap.cal_gain
+		<< " (Q16.16), table points " << snap.cal_lut_len
+		<< (snap.word_read ? ", 16-bit reads" : ", 8-bit reads") << endl;
+	    if(error_type.empty())
+		cout << "Last error: none" << endl;
+	    else
+		cout << "Last error: " << format_nanoseconds_to_datetime(snap.last_error_ns)
+		<< " - Type of error: " << error_type << endl;
     }
 };
 
@@ -205,9 +1072,17 @@ int main(int argc, char* argv[]) {
         cout << "\tload                \tLoad the driver" << endl;
         cout << "\tunload              \tUnload the driver" << endl;
         cout << "\trun                 \tStart reading temperature values" << endl;    
+        cout << "\tserve               \tRead the device and share the samples with attached clients" << endl;
+        cout << "\tattach              \tRead temperature values shared by serve" << endl;
+#ifdef URING
+        cout << "\trun_uring [devices] \tStart reading temperature values from one or many devices using io_uring" << endl;
+#endif
         cout << "\tsampling [argument] \tSet the sampling rate (in milliseconds)" << endl;
         cout << "\thtemp [argument]    \tSet the alert for high temperature (in millidegrees Celsius)" << endl;
         cout << "\tltemp [argument]    \tSet the alert for low temperature (in millidegrees Celsius)" << endl;
+        cout << "\thorizon [argument] \tSet the horizon for predicted alerts (in milliseconds, 0 disables)" << endl;
+        cout << "\tcal_offset [argument]\tSet the calibration offset (in millidegrees Celsius)" << endl;
+        cout << "\tcal_gain [argument] \tSet the calibration gain (Q16.16, 65536 is 1.0)" << endl;
         cout << "\ts_mode [argument]     \tSet the mode - normal, noisy or ramp" << endl;
 	cout << "\tg_mode [argument]     \tGet the current mode" << endl;
         cout << "\tstats               \tShow statistics\n" << endl;
@@ -219,25 +1094,53 @@ int main(int argc, char* argv[]) {
         cout << "\t--help    Display this help message\n" << endl;
     } else if (argc > 1 && std::string(argv[1]) == "load") {
 #ifdef REAL	
-	ops.load_overlay();
+	if(ops.load_overlay() < 0)
+	    return 1;
 #endif	
-        ops.load_driver();
+        if(ops.load_driver() < 0){
+#ifdef REAL
+	    /*Otherwise the next load fails creating the overlay directory*/
+	    ops.unload_overlay();
+#endif
+	    return 1;
+	}
       std::cout << "Driver loaded" << std::endl;
     } else if (argc > 1 && std::string(argv[1]) == "unload") {
-        ops.unload_driver();
+        if(ops.unload_driver() < 0)
+	    return 1;
 #ifdef REAL
-	ops.unload_overlay();
+	if(ops.unload_overlay() < 0)
+	    return 1;
 #endif	
         std::cout << "Driver unloaded" << std::endl;  
     } else if (argc > 1 && std::string(argv[1]) == "run") {
 	std::cout << "Reading temperature:" << std::endl;
         ops.run();
+    } else if (argc > 1 && std::string(argv[1]) == "serve") {
+        ops.serve();
+    } else if (argc > 1 && std::string(argv[1]) == "attach") {
+	std::cout << "Reading temperature:" << std::endl;
+        ops.attach();
+#ifdef URING
+    } else if (argc > 1 && std::string(argv[1]) == "run_uring") {
+	vector<string> devices(argv + 2, argv + argc);
+	if(devices.empty())
+	    devices.push_back(FD_PATH);
+	std::cout << "Reading temperature:" << std::endl;
+        ops.run_uring(devices);
+#endif
     } else if (argc > 1 && std::string(argv[1]) == "sampling" && ops.isInteger(std::string(argv[2]))) {
         ops.set_sampling(atoi(argv[2]));
     } else if (argc > 1 && std::string(argv[1]) == "htemp" && ops.isInteger(std::string(argv[2]))) {
         ops.set_htemp(atoi(argv[2]));
     } else if (argc > 1 && std::string(argv[1]) == "ltemp" && ops.isInteger(std::string(argv[2]))) {
         ops.set_ltemp(atoi(argv[2]));
+    } else if (argc > 2 && std::string(argv[1]) == "horizon" && ops.isInteger(std::string(argv[2]))) {
+        ops.set_horizon(atoi(argv[2]));
+    } else if (argc > 2 && std::string(argv[1]) == "cal_offset" && ops.isSignedInteger(std::string(argv[2]))) {
+        ops.set_cal_offset(atoi(argv[2]));
+    } else if (argc > 2 && std::string(argv[1]) == "cal_gain" && ops.isInteger(std::string(argv[2]))) {
+        ops.set_cal_gain(atoi(argv[2]));
     } else if (argc > 1 && std::string(argv[1]) == "s_mode" && (std::string(argv[2])=="normal" || std::string(argv[2])=="noisy" || std::string(argv[2])=="ramp")) {
         ops.set_mode(std::string(argv[2]));
     } else if (argc > 1 && std::string(argv[1]) == "g_mode"){